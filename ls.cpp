@@ -1,6 +1,9 @@
 /**
  * Sample implementation of Linux ls command
  * 
+ * compiled with LS_BUILTIN defined (see mshell.cpp) main() is left out
+ * and the listing is reachable in-process through ls::ls_main()
+ * 
  * @author Mushfekur Rahman
  * @since 1.0
  **/
@@ -21,6 +24,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #define DEBUG if(1)
 #define max(a,b) ((a)>(b)?(a):(b))
@@ -41,6 +45,8 @@
 	#define BLOCKSIZE 512
 #endif
 
+namespace ls {
+
 typedef struct dirent DIRENT;
 typedef struct stat STAT;
 typedef struct passwd PWD;
@@ -70,7 +76,7 @@ char **pathv; int npathv;
 char **soptv; int nsoptv;
 char **loptv; int nloptv;
 char cwd[2] = ".";
-int pathentry, sortingmode, timeformat, sizeformat, argsort;
+int pathentry, sortingmode, timeformat, sizeformat, argsort, nerrors;
 
 /** output formatting settings **/
 static int LSOPT_1; // force output one entry per line
@@ -103,11 +109,17 @@ static int LSOPT_u; // use time last accessed in sorting with -t
 static int LSOPT_w; // force raw formatting
 /********************************/
 
+int ls_main(int, char **);
+void reset_state(void);
 void insert(DLL *, char *);
+void makeEntry(Data *, char *);
+void append(DLL *, Data);
 void erase(DLL *);
 void init_display_formats(void);
 void traverseDirectory(char *);
 int argcomp(const void *, const void *);
+int entcomp(const void *, const void *);
+int statcomp(char *, STAT *, char *, STAT *);
 int mode(char *);
 void errormsg(char *, char *, int);
 void printFormatted(DLL *);
@@ -115,10 +127,11 @@ void getActualName(char *, char **);
 int mystrcmp(char *, char *);
 void printMode(STAT *, char *, int);
 
-int main(int argc, char **argv) {
+int ls_main(int argc, char **argv) {
 	int i, cs, nxt, md;
 	DLL *dlist;
 	DIR *dir;
+	reset_state();
 	pathv = new char*[argc];
 	soptv = new char*[argc];
 	loptv = new char*[argc];
@@ -184,10 +197,22 @@ int main(int argc, char **argv) {
 		}
 	}
 	erase(dlist);
-	delete pathv;
-	delete soptv;
-	delete loptv;
-	return 0;
+	delete [] pathv;
+	delete [] soptv;
+	delete [] loptv;
+	fflush(stdout);
+	return (nerrors ? 2 : 0);
+}
+
+// clears everything a previous ls_main() left behind, so it can run again
+void reset_state() {
+	pathv = soptv = loptv = NULL;
+	npathv = nsoptv = nloptv = 0;
+	pathentry = sortingmode = timeformat = sizeformat = argsort = nerrors = 0;
+	LSOPT_1 = LSOPT_A = LSOPT_a = LSOPT_B = LSOPT_c = LSOPT_d = LSOPT_F = 0;
+	LSOPT_f = LSOPT_G = LSOPT_g = LSOPT_H = LSOPT_h = LSOPT_i = LSOPT_k = 0;
+	LSOPT_l = LSOPT_m = LSOPT_n = LSOPT_o = LSOPT_Q = LSOPT_q = LSOPT_R = 0;
+	LSOPT_r = LSOPT_S = LSOPT_s = LSOPT_t = LSOPT_U = LSOPT_u = LSOPT_w = 0;
 }
 
 void init_display_formats() {
@@ -237,29 +262,34 @@ void init_display_formats() {
 void traverseDirectory(char *path) {
 	DIR *tmpdir;
 	DIRENT *tmpdirent;
-	DLL *dlist = new DLL;
+	DLL *dlist;
 	Node *curr;
-	char **tmpv, *tmpbuf, *act;
-	int ntmpv, i, md, nxt, tmpsz = 0;
-	tmpdir = opendir(path);
+	Data *tmpv, *grow;
+	char *tmpbuf;
+	int ntmpv, i, tmpsz = 0, tmpcap = 64;
+	if((tmpdir = opendir(path)) == NULL) {
+		errormsg((char *)"ls: cannot open directory", path, errno);
+		return;
+	}
+	// every entry is lstat()'ed exactly once, sorting works on the cached data
+	tmpv = new Data[tmpcap]; ntmpv = 0;
 	while((tmpdirent = readdir(tmpdir)) != NULL) {
 		tmpbuf = new char[strlen(path) + strlen(tmpdirent->d_name) + 2];
 		strcpy(tmpbuf, path); strcat(tmpbuf, "/"); strcat(tmpbuf, tmpdirent->d_name);
-		insert(dlist, tmpbuf);
+		if(ntmpv == tmpcap) {
+			grow = new Data[tmpcap <<= 1];
+			memcpy(grow, tmpv, ntmpv * sizeof(Data));
+			delete [] tmpv;
+			tmpv = grow;
+		}
+		makeEntry(&tmpv[ntmpv++], tmpbuf);
 	}
 	closedir(tmpdir);
-	tmpv = new char*[dlist->size];
-	curr = dlist->head; ntmpv = 0;
-	while(curr) {
-		tmpv[ntmpv++] = curr->entry.name;
-		curr = curr->next;
-	}
-	erase(dlist);
+	qsort(tmpv, ntmpv, sizeof(Data), entcomp);
 	dlist = new DLL;
-	qsort(tmpv, ntmpv, sizeof(char *), argcomp);
-	for(i = 0; i < ntmpv; i++) {
-		insert(dlist, tmpv[i]);
-		curr = dlist->tail;
+	for(i = 0; i < ntmpv; i++) append(dlist, tmpv[i]);
+	delete [] tmpv;
+	for(curr = dlist->head; curr; curr = curr->next) {
 		if(!LSOPT_a) {
 			if(LSOPT_A && !strcmp(curr->entry.actual, ".")) continue;
 			if(LSOPT_A && !strcmp(curr->entry.actual, "..")) continue;
@@ -271,30 +301,25 @@ void traverseDirectory(char *path) {
 	if(LSOPT_l || LSOPT_s) printf("total %d\n", tmpsz >> 1);
 	printFormatted(dlist);
 	if(LSOPT_R) {
-		for(i = 0; i < ntmpv; i++) {
-			getActualName(tmpv[i], &act);
-			if(!strcmp(act, ".") || !strcmp(act, "..")) continue;
-			nxt = LSOPT_l; LSOPT_l = 1;
-			md = mode(tmpv[i]);
-			LSOPT_l = nxt;
-			if((md & S_IFMT) == S_IFDIR) {
-				if((tmpdir = opendir(tmpv[i])) == NULL) {
-					errormsg((char *)"ls: cannot open directory", tmpv[i], errno);
+		for(curr = dlist->head; curr; curr = curr->next) {
+			if(!strcmp(curr->entry.actual, ".") || !strcmp(curr->entry.actual, "..")) continue;
+			if((curr->entry.stat.st_mode & S_IFMT) == S_IFDIR) {
+				if((tmpdir = opendir(curr->entry.name)) == NULL) {
+					errormsg((char *)"ls: cannot open directory", curr->entry.name, errno);
 				}
 				else {
 					closedir(tmpdir);
 					printf("\n");
 					if(LSOPT_Q) printf("\"");
-					printf("%s", tmpv[i]);
+					printf("%s", curr->entry.name);
 					if(LSOPT_Q) printf("\"");
 					printf(":\n");
-					traverseDirectory(tmpv[i]);
+					traverseDirectory(curr->entry.name);
 				}
 			}
 		}
 	}
 	erase(dlist);
-	delete tmpv;
 }
 
 void printFormatted(DLL *root) {
@@ -372,9 +397,7 @@ void printFormatted(DLL *root) {
 		if(LSOPT_F) { printMode(&curr->entry.stat, &ch, 0); printf("%c", ch); }
 		if(LSOPT_l && (curr->entry.stat.st_mode & S_IFMT) == S_IFLNK) {
 			printf(" -> ");
-			if((len = readlink(curr->entry.name, buff, 256)) == -1) {
-				exit(errno);
-			}
+			if((len = readlink(curr->entry.name, buff, 255)) == -1) len = 0;
 			buff[len] = 0;
 			if(LSOPT_Q) printf("\""); printf("%s", buff); if(LSOPT_Q) printf("\"");
 			if(LSOPT_F) {
@@ -392,42 +415,52 @@ int argcomp(const void *a, const void *b) {
 	char **x = (char **)a;
 	char **y = (char **)b;
 	STAT sa, sb;
-	int da, db;
 	int (*mystat)(const char*, STAT*) = NULL;
 	if(argsort) {
 		if(LSOPT_l && !LSOPT_H) mystat = &lstat;
 		else mystat = &stat;
 	}
 	else mystat = &lstat;
-	da = mystat(*x, &sa);
-	db = mystat(*y, &sb);
-	assert(da > -1 && db > -1);
-	da = ((sa.st_mode & S_IFMT) == S_IFDIR);
-	db = ((sb.st_mode & S_IFMT) == S_IFDIR);
+	// entries may vanish between readdir() and sorting
+	if(mystat(*x, &sa) == -1) memset(&sa, 0, sizeof(STAT));
+	if(mystat(*y, &sb) == -1) memset(&sb, 0, sizeof(STAT));
+	return statcomp(*x, &sa, *y, &sb);
+}
+
+int entcomp(const void *a, const void *b) {
+	Data *x = (Data *)a;
+	Data *y = (Data *)b;
+	return statcomp(x->name, &x->stat, y->name, &y->stat);
+}
+
+int statcomp(char *x, STAT *sa, char *y, STAT *sb) {
+	int da, db;
+	da = ((sa->st_mode & S_IFMT) == S_IFDIR);
+	db = ((sb->st_mode & S_IFMT) == S_IFDIR);
 	if(argsort && !LSOPT_d && da != db) return da - db;
 	if(sortingmode == SORT_BY_NAME) {
-		if(LSOPT_r) return mystrcmp(*y, *x);
-		return mystrcmp(*x, *y);
+		if(LSOPT_r) return mystrcmp(y, x);
+		return mystrcmp(x, y);
 	}
 	else if(sortingmode == SORT_BY_SIZE) {
-		if(LSOPT_r) return sa.st_size - sb.st_size;
-		return sb.st_size - sa.st_size;
+		if(LSOPT_r) return sa->st_size - sb->st_size;
+		return sb->st_size - sa->st_size;
 	}
 	else if(sortingmode == SORT_BY_TIME) {
 		if(timeformat == TIME_LAST_MODIFIED) {
-			if(LSOPT_r) return sa.st_mtime - sb.st_mtime;
-			return sb.st_mtime - sa.st_mtime;
+			if(LSOPT_r) return sa->st_mtime - sb->st_mtime;
+			return sb->st_mtime - sa->st_mtime;
 		}
 		else if(timeformat == TIME_LAST_ACCESSED) {
-			if(LSOPT_r) return sa.st_atime - sb.st_atime;
-			return sb.st_atime - sa.st_atime;
+			if(LSOPT_r) return sa->st_atime - sb->st_atime;
+			return sb->st_atime - sa->st_atime;
 		}
 		else if(timeformat == TIME_LAST_FLAGCNGD) {
-			if(LSOPT_r) return sa.st_ctime - sb.st_ctime;
-			return sb.st_ctime - sa.st_ctime;
+			if(LSOPT_r) return sa->st_ctime - sb->st_ctime;
+			return sb->st_ctime - sa->st_ctime;
 		}
 	}
-	else return -1;
+	return -1;
 }
 
 int mode(char *d_name) {
@@ -442,15 +475,25 @@ int mode(char *d_name) {
 void insert(DLL *root, char *name) {
 	if(!root) return;
 	Data entry;
+	char *copy = new char[strlen(name)+1];
+	strcpy(copy, name);
+	makeEntry(&entry, copy);
+	append(root, entry);
+}
+
+// fills entry for name, taking ownership of the buffer
+void makeEntry(Data *entry, char *name) {
 	int len, i;
-	entry.name = new char[strlen(name)+1];
-	strcpy(entry.name, name);
-	getActualName(entry.name, &entry.actual);
+	entry->name = name;
+	getActualName(entry->name, &entry->actual);
 	if(LSOPT_q) {
-		len = strlen(entry.actual);
-		for(i = 0; i < len; i++) if(entry.actual[i] >= 128) entry.actual[i] = '?';
+		len = strlen(entry->actual);
+		for(i = 0; i < len; i++) if(entry->actual[i] >= 128) entry->actual[i] = '?';
 	}
-	lstat(name, &entry.stat);
+	if(lstat(name, &entry->stat) == -1) memset(&entry->stat, 0, sizeof(STAT));
+}
+
+void append(DLL *root, Data entry) {
 	root->size++;
 	if(root->head == NULL) {
 		root->head = new Node();
@@ -470,6 +513,7 @@ void erase(DLL *root) {
 	while(root->head) {
 		temp = root->head;
 		root->head = root->head->next;
+		delete [] temp->entry.name;
 		delete temp;
 	}
 	delete root;
@@ -477,7 +521,8 @@ void erase(DLL *root) {
 
 void errormsg(char *pre, char *msg, int err) {
 	char buff[128];
-	sprintf(buff, "%s %s", pre, msg);
+	snprintf(buff, sizeof(buff), "%s %s", pre, msg);
+	nerrors++;
 	errno = err;
 	perror(buff);
 }
@@ -543,4 +588,12 @@ void printMode(STAT *st, char *ch, int print) {
 	else printf("-");
 }
 
+} // namespace ls
+
+#ifndef LS_BUILTIN
+int main(int argc, char **argv) {
+	return ls::ls_main(argc, argv);
+}
+#endif
+
 /** end of source code **/
@@ -1,58 +1,274 @@
 /**
  * mShell: A simple Linux Shell
  * 
+ * usage: mshell [-e] [-c commands | script.msh | command [args...]]
+ * 
  * @author Mushfekur Rahman
  * @since 1.0
  **/
 
+#include <errno.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// 'ls' runs in-process as a builtin; pulls in ls::ls_main() without its main()
+#define LS_BUILTIN
+#include "ls.cpp"
+
+// size of a single read() while consuming script / batch input
+#define INPUT_BLOCK 65536
+
+// where '@run --cgroup' jobs get their leaf cgroup (cgroup v2 only); the
+// default parent is a subtree of its own rather than the shell's cgroup,
+// since v2 won't hand controllers below a cgroup that holds processes
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_PARENT CGROUP_ROOT "/mshell"
+#define CGROUP2_MAGIC 0x63677270
+
+// output formats for '@bench'
+#define BENCH_TEXT 0
+#define BENCH_CSV  1
+#define BENCH_JSON 2
+
+// message types between the shell and its zygote
+#define ZYGOTE_SPAWN   0
+#define ZYGOTE_STARTED 1
+#define ZYGOTE_EXITED  2
+// the zygote is a fresh exec of this binary, talking on this descriptor
+#define ZYGOTE_SOCK    3
+
+// histogram bucket counts for '@metrics' (upper bounds in seconds)
+#define SPAWN_BUCKETS 7
+#define WALL_BUCKETS 8
 
-// flag for enabling / disabling status display
+// counters opened per job by '@stats perf'
+#define PERF_EVENTS 5
+
+// flag for enabling / disabling status display (2 adds perf counters)
 int __SHOW_DETAILS__ = 0;
 int __CURR_BCKGRND__ = 0;
+// flags for script / batch execution
+int __INTERACTIVE__ = 0;
+int __EXIT_ON_ERROR__ = 0;
+int __LAST_STATUS__ = 0;
+// flag for running builtin commands (ls) inside the shell process
+int __BUILTINS__ = 1;
+// socket to the spawn helper started by '@zygote on', -1 when disabled
+int __ZYGOTE_FD__ = -1;
+pid_t __ZYGOTE_PID__ = 0;
+// self-pipe written by the SIGCHLD handler so waits can wake on job exits
+int __NOTIFY_PIPE__[2] = { -1, -1 };
+// what '@on-complete' runs / writes to when a background job finishes
+char **__HOOK_ARGV__ = NULL;
+char *__HOOK_FIFO__ = NULL;
+// listening socket of '@metrics on', -1 when telemetry is off
+int __METRICS_FD__ = -1;
+int __METRICS_JSON__ = 0;
+pid_t __METRICS_OWNER__ = 0;
+char __METRICS_PATH__[108];
+
+// scheduling controls for a single job, set with '@run'
+struct Sched {
+	cpu_set_t cpus;
+	int ncpus, nice, hasnice, cgroup;
+	long mem;
+	char cgpath[PATH_MAX];
+};
 
 struct Node {
 	rusage ru;
 	timeval st, en;
 	char name[128];
-	int pid, done, sl;
+	char cgpath[PATH_MAX];
+	int pid, done, sl, status, execd;
+	int perf[PERF_EVENTS];
 	Node *next;
 } *head, *tail;
 
+// buffered line reader over a file descriptor or an in-memory string
+struct Input {
+	int fd, eof;
+	char *buf, *line;
+	long len, pos, lcap;
+};
+
+// reusable storage for the words of a command line; argv entries point
+// into buf, and both only ever grow so steady-state parsing allocates nothing
+struct Arena {
+	char *buf, **argv;
+	long cap, used;
+	int argc, acap, background;
+} arena;
+
+// header of every shell <-> zygote message; a ZYGOTE_SPAWN request is
+// followed by len bytes holding cwd, argc argv strings and envc environ
+// strings, and carries the worker's stdin / stdout / stderr as SCM_RIGHTS
+struct ZygoteMsg {
+	int type, argc, envc, status;
+	long len;
+	pid_t pid;
+	rusage ru;
+};
+
+// per command name usage collected while '@metrics' is on
+struct Metric {
+	char name[128];
+	long count, buckets[WALL_BUCKETS + 1];
+	double wall, user, sys;
+	Metric *next;
+} *metrics;
+
+// session wide counters collected while '@metrics' is on
+struct Counters {
+	long spawned, completed, forkfail, execfail;
+	long spawnb[SPAWN_BUCKETS + 1];
+	double spawnsum;
+} counters;
+
+// events read by '@stats perf'; hardware ones may be missing on VMs or
+// when perf_event_paranoid forbids them, the software ones nearly never are
+struct PerfEvent {
+	unsigned type;
+	unsigned long long config;
+} perfEvents[PERF_EVENTS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK }
+};
+
+double spawnBounds[SPAWN_BUCKETS] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01 };
+double wallBounds[WALL_BUCKETS] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5 };
+
+extern char **environ;
+
 // functions used for our shell 'mShell' 
 void add(Node);
 void del(int);
-void find(int, Node *);
-void changeDirectory(char *);
+Node * find(int);
+int changeDirectory(char *);
 void printWorkingDirectory(void);
 void getCurrentDirectory(char *);
 void signalHandler(int);
-void showCompletedJobs(int);
+int showCompletedJobs(int);
 void showRunningJobs(void);
 void printMessage(timeval *, timeval *, rusage *);
+void openInput(Input *, int, char *);
+void closeInput(Input *);
+char * readLine(Input *);
+int isScript(char *);
+int runShell(Input *);
+int executeCommand(char *, int *);
+int exitStatus(int);
+int tokenize(char *, Arena *);
+void reserve(Arena *, long);
+void pushArg(Arena *, char *);
+int runBuiltin(int (*)(int, char **), int, char **);
+int parseSched(int, char **, Sched *);
+int parseCpus(char *, cpu_set_t *);
+long parseSize(char *);
+int createCgroup(Sched *);
+int applySched(Sched *);
+void removeCgroup(char *);
+void formatCpus(cpu_set_t *, char *, int);
+void showPlacement(Node *);
+int benchmark(int, char **);
+int benchRun(char **, int, double *, rusage *);
+void pace(timespec *, long);
+int dblcomp(const void *, const void *);
+double percentile(double *, int, double);
+void printRow(const char *, double *, int, int);
+int zygoteStart(void);
+void zygoteStop(void);
+void zygoteLoop(int);
+pid_t zygoteWorker(int, char *, char **, char **, int *);
+pid_t zygoteSpawn(char **, int *);
+int zygoteWait(pid_t, int *, rusage *);
+int readFull(int, void *, long);
+int writeFull(int, void *, long);
+void showPrompt(void);
+int waitEvents(int, int);
+pid_t waitForeground(pid_t, int *, rusage *);
+int drainNotify(void);
+int setHook(int, char **);
+void runHook(Node *);
+int metricsStart(char *, int);
+void metricsStop(void);
+void metricsServe(void);
+void recordSpawn(double);
+void recordCommand(char *, double, rusage *, int);
+int bucketOf(double *, int, double);
+void appendf(char **, long *, long *, const char *, ...);
+void appendLabel(char **, long *, long *, char *);
+int perfOpen(pid_t, int *, int);
+void perfClose(int *);
+void printPerf(int *);
 
 int main(int argc, char **argv) {
-	char argument[128], temp[128];
-	char *p, sargs[32][128], *pargs[32];
-	int i, child_status, background;
+	char **pargs, *cmd = NULL;
+	int i, fd, child_status;
 	pid_t pid, wait_pid;
-	Node b;
 	timeval st, en;
 	rusage rs;
+	Input in;
 
+	// re-exec'd by zygoteStart(), see there
+	if(argc == 2 && !strcmp(argv[1], "--zygote")) {
+		zygoteLoop(ZYGOTE_SOCK);
+		return 0;
+	}
+	if(pipe2(__NOTIFY_PIPE__, O_NONBLOCK | O_CLOEXEC) == -1) __NOTIFY_PIPE__[0] = __NOTIFY_PIPE__[1] = -1;
 	signal(SIGCHLD, signalHandler);
 	signal(SIGINT, SIG_IGN);
 
-	if(argc > 1) {
-		for(i = 1; i < argc; i++) pargs[i-1] = argv[i]; pargs[i-1] = NULL;
+	for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if(!strcmp(argv[i], "-e")) __EXIT_ON_ERROR__ = 1;
+		else if(!strcmp(argv[i], "-c") && i+1 < argc) cmd = argv[++i];
+		else if(!strcmp(argv[i], "--")) { i++; break; }
+		else {
+			printf("mShell: %s: invalid option...\nusage: mshell [-e] [-c commands | script.msh | command [args...]]\n", argv[i]);
+			return 2;
+		}
+	}
+
+	if(cmd) {
+		openInput(&in, -1, cmd);
+		return runShell(&in);
+	}
+	if(i < argc && isScript(argv[i])) {
+		if((fd = open(argv[i], O_RDONLY | O_CLOEXEC)) == -1) {
+			printf("mShell: %s: cannot open script...\n", argv[i]);
+			return 127;
+		}
+		openInput(&in, fd, NULL);
+		__LAST_STATUS__ = runShell(&in);
+		close(fd);
+		return __LAST_STATUS__;
+	}
+	if(i < argc) {
+		pargs = argv + i;
 		
 		pid = fork();
 
@@ -67,103 +283,1460 @@ int main(int argc, char **argv) {
 		}
 		else {
 			gettimeofday(&st, NULL);
-			if((wait_pid = waitpid(pid, &child_status, 0)) == -1) {
+			if((wait_pid = wait4(pid, &child_status, 0, &rs)) == -1) {
 				printf("mShell: system call waitpid() failed...\n");
 				exit(3);
 			}
-			getrusage(RUSAGE_CHILDREN, &rs);
 			gettimeofday(&en, NULL);
 			
 			if(__SHOW_DETAILS__) {
 				printf("PID %d\t[%s] completed.\n", wait_pid, pargs[0]);
 				printMessage(&st, &en, &rs);
 			}
+			return exitStatus(child_status);
 		}
 	}
-	else {
-		while(1) {
-			getCurrentDirectory(temp);
-			printf("mShell [%s]$ ", temp);
 
-			fgets(argument, 128, stdin);
-			p = strtok(argument, " \n");
+	// prompts are only rendered when a terminal is attached
+	__INTERACTIVE__ = isatty(fileno(stdin));
+	openInput(&in, fileno(stdin), NULL);
+	return runShell(&in);
+}
+
+int runShell(Input *in) {
+	char *line;
+	int quit = 0, status;
 
+	while(!quit) {
+		if(__INTERACTIVE__) showPrompt();
+
+		if((line = readLine(in)) == NULL) {
+			showCompletedJobs(0);
+			if(__INTERACTIVE__) printf("\nmShell: exiting shell...\n");
+			break;
+		}
+
+		showCompletedJobs(0);
+
+		status = executeCommand(line, &quit);
+		if(status < 0) continue;
+		__LAST_STATUS__ = status;
+		if(status && __EXIT_ON_ERROR__ && !quit) {
 			showCompletedJobs(0);
+			break;
+		}
+	}
+	closeInput(in);
+
+	return __LAST_STATUS__;
+}
+
+/**
+ * runs a single command line; returns its exit status or -1
+ * if the line was empty. *quit is set once 'exit' is issued.
+ **/
+int executeCommand(char *line, int *quit) {
+	char **pargs, *opt;
+	int i, n, child_status, background;
+	pid_t pid, wait_pid;
+	Node b;
+	timeval st, en;
+	rusage rs;
+	sigset_t mask, omask;
+	Sched sc;
+	int ep[2], sp[2], perf[PERF_EVENTS], execd = 1;
+
+	if((i = tokenize(line, &arena)) <= 0) return i ? 2 : -1;
+	pargs = arena.argv;
+	background = arena.background;
+	opt = (i > 1 ? pargs[1] : (char *)"");
+	memset(&sc, 0, sizeof(Sched));
+
+	// '@run [options] cmd' : strip the modifiers, always fork the command
+	if(!strcmp(pargs[0], "@run")) {
+		if((n = parseSched(i, pargs, &sc)) < 0) return 2;
+		pargs += n; i -= n;
+		if(sc.cgroup && createCgroup(&sc) == -1) return 1;
+		goto spawn;
+	}
 
-			if(!p) continue;
+	if(!strcmp(pargs[0], "exit")) {
+		showCompletedJobs(1);
+		if(__INTERACTIVE__) printf("\nmShell: exiting shell...\n");
+		*quit = 1;
+		return (i > 1 ? atoi(opt) : __LAST_STATUS__);
+	}
+	if(!strcmp(pargs[0], "cd")) {
+		return changeDirectory(opt);
+	}
+	if(!strcmp(pargs[0], "pwd")) {
+		printWorkingDirectory();
+		return 0;
+	}
+	if(!strcmp(pargs[0], "jobs")) {
+		showCompletedJobs(1);
+		return 0;
+	}
+	if(!strcmp(pargs[0], "set")) {
+		if(!strcmp(opt, "-e")) __EXIT_ON_ERROR__ = 1;
+		else if(!strcmp(opt, "+e")) __EXIT_ON_ERROR__ = 0;
+		else printf("Exit on error: %s\nOptions: [-e/+e]\n", (__EXIT_ON_ERROR__? "ON" : "OFF"));
+		return 0;
+	}
+	if(!strcmp(pargs[0], "@builtins")) {
+		if(!strcmp(opt, "on")) __BUILTINS__ = 1;
+		else if(!strcmp(opt, "off")) __BUILTINS__ = 0;
+		else printf("In-process builtins (ls): %s\nOptions: [on/off]\n", (__BUILTINS__? "ON" : "OFF"));
+		return 0;
+	}
+	if(__BUILTINS__ && !background && !strcmp(pargs[0], "ls")) {
+		return runBuiltin(ls::ls_main, i, pargs);
+	}
+	if(!strcmp(pargs[0], "@zygote")) {
+		if(!strcmp(opt, "on")) return (__ZYGOTE_FD__ == -1 ? zygoteStart() : 0);
+		else if(!strcmp(opt, "off")) zygoteStop();
+		else printf("Zygote: %s\nOptions: [on/off]\n", (__ZYGOTE_FD__ != -1 ? "ON" : "OFF"));
+		return 0;
+	}
+	if(!strcmp(pargs[0], "@metrics")) {
+		if(!strcmp(opt, "on")) {
+			if(__METRICS_FD__ != -1) metricsStop();
+			return metricsStart((i > 2 && pargs[2][0] != '-' ? pargs[2] : NULL), !strcmp(pargs[i-1], "--json"));
+		}
+		else if(!strcmp(opt, "off")) metricsStop();
+		else if(__METRICS_FD__ != -1) printf("Telemetry: ON (%s, %s)\nOptions: [on [PATH] [--json] / off]\n", __METRICS_PATH__, (__METRICS_JSON__ ? "json" : "prometheus"));
+		else printf("Telemetry: OFF\nOptions: [on [PATH] [--json] / off]\n");
+		return 0;
+	}
+	if(!strcmp(pargs[0], "@on-complete")) {
+		return setHook(i, pargs);
+	}
+	if(!strcmp(pargs[0], "@bench")) {
+		return benchmark(i, pargs);
+	}
+	if(!strcmp(pargs[0], "@stats")) {
+		if(!strcmp(opt, "on")) __SHOW_DETAILS__ = 1;
+		else if(!strcmp(opt, "off")) __SHOW_DETAILS__ = 0;
+		else if(!strcmp(opt, "perf")) {
+			// probe on ourselves once so the user learns up front what will be counted
+			if((n = perfOpen(0, perf, 0)) == 0) printf("mShell: perf_event_open() unavailable (%s), showing rusage only...\n", strerror(errno));
+			else if(perf[0] == -1 && perf[1] == -1) printf("mShell: hardware counters unavailable, showing software events only...\n");
+			perfClose(perf);
+			__SHOW_DETAILS__ = 2;
+		}
+		else printf("Status display: %s\nOptions: [on/perf/off]\n", (__SHOW_DETAILS__ == 2 ? "PERF" : __SHOW_DETAILS__ ? "ON" : "OFF"));
+		return 0;
+	}
 
-			for(i = 0; p; i++, p = strtok(0, " \n")) {
-				strcpy(sargs[i], p);
-				pargs[i] = sargs[i];
+spawn:
+	// foreground commands without '@run' modifiers go through the zygote;
+	// perf counters have to be attached before exec, so those always fork
+	if(__ZYGOTE_FD__ != -1 && __SHOW_DETAILS__ != 2 && !background && !sc.ncpus && !sc.hasnice && !sc.mem && !sc.cgpath[0]) {
+		int fds[3] = { 0, 1, 2 };
+		fflush(stdout);
+		gettimeofday(&st, NULL);
+		if((pid = zygoteSpawn(pargs, fds)) > 0) {
+			gettimeofday(&en, NULL);
+			recordSpawn((en.tv_sec - st.tv_sec) + (en.tv_usec - st.tv_usec) / 1000000.0);
+			if(zygoteWait(pid, &child_status, &rs) == -1) return 1;
+			gettimeofday(&en, NULL);
+			recordCommand(pargs[0], (en.tv_sec - st.tv_sec) + (en.tv_usec - st.tv_usec) / 1000000.0, &rs, 1);
+			if(__SHOW_DETAILS__) {
+				printf("PID %d\t[%s] completed.\n", pid, pargs[0]);
+				printMessage(&st, &en, &rs);
 			}
-			if(i && !strcmp(sargs[i-1], "&")) { background = 1; i--; }
-			else background = 0;
-			pargs[i] = NULL; sargs[i][0] = 0;
-
-			if(!strcmp(sargs[0], "exit")) {
-				showCompletedJobs(1);
-				printf("\nmShell: exiting shell...\n");
-				return atoi(sargs[1]);
+			return exitStatus(child_status);
+		}
+	}
+
+	// keep SIGCHLD away until a background job is registered in the list
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &omask);
+	fflush(stdout);
+	// with telemetry on, a close-on-exec pipe tells exec success from failure
+	if(__METRICS_FD__ == -1 || pipe2(ep, O_CLOEXEC) == -1) ep[0] = ep[1] = -1;
+	// with '@stats perf' the child waits on this pipe until its counters exist
+	if(__SHOW_DETAILS__ != 2 || pipe2(sp, O_CLOEXEC) == -1) sp[0] = sp[1] = -1;
+	for(n = 0; n < PERF_EVENTS; n++) perf[n] = -1;
+	gettimeofday(&st, NULL);
+
+	pid = fork();
+
+	if(pid == -1) {
+		printf("mShell: system call fork() failed...\n");
+		if(__METRICS_FD__ != -1) counters.forkfail++;
+		if(ep[0] != -1) { close(ep[0]); close(ep[1]); }
+		if(sp[0] != -1) { close(sp[0]); close(sp[1]); }
+		sigprocmask(SIG_SETMASK, &omask, NULL);
+		removeCgroup(sc.cgpath);
+		return 1;
+	}
+	if(!pid) {
+		sigprocmask(SIG_SETMASK, &omask, NULL);
+		if(sp[0] != -1) {
+			close(sp[1]);
+			while(read(sp[0], &n, 1) == -1 && errno == EINTR);
+		}
+		if(applySched(&sc) == -1) {
+			if(ep[1] != -1) write(ep[1], &errno, sizeof(int));
+			exit(126);
+		}
+		execvp(pargs[0], pargs);
+		if(ep[1] != -1) write(ep[1], &errno, sizeof(int));
+		printf("mShell: %s: command not found...\n", pargs[0]);
+		exit(2);
+	}
+	else {
+		if(sp[0] != -1) {
+			// counting starts at exec and follows the job's own children
+			close(sp[0]);
+			perfOpen(pid, perf, 1);
+			close(sp[1]);
+		}
+		if(ep[0] != -1) {
+			close(ep[1]);
+			while((n = read(ep[0], &child_status, sizeof(int))) == -1 && errno == EINTR);
+			close(ep[0]);
+			gettimeofday(&en, NULL);
+			if(n > 0) counters.execfail++, execd = 0;
+			else recordSpawn((en.tv_sec - st.tv_sec) + (en.tv_usec - st.tv_usec) / 1000000.0);
+		}
+		if(background) {
+			memset(&b, 0, sizeof(Node));
+			b.pid = pid; strncpy(b.name, pargs[0], 127);
+			strcpy(b.cgpath, sc.cgpath);
+			b.st = st; b.done = 1; b.execd = execd;
+			memcpy(b.perf, perf, sizeof(perf));
+			b.sl = ++__CURR_BCKGRND__;
+			add(b);
+			sigprocmask(SIG_SETMASK, &omask, NULL);
+			printf("[%d] %d\t[%s]\n", b.sl, pid, pargs[0]);
+			return 0;
+		}
+		else {
+			sigprocmask(SIG_SETMASK, &omask, NULL);
+			if((wait_pid = waitForeground(pid, &child_status, &rs)) == -1) {
+				printf("mShell: system call wait() failed...\n");
+				exit(4);
 			}
-			if(!strcmp(sargs[0], "cd")) {
-				changeDirectory(sargs[1]);
-				continue;
+			gettimeofday(&en, NULL);
+			removeCgroup(sc.cgpath);
+			recordCommand(pargs[0], (en.tv_sec - st.tv_sec) + (en.tv_usec - st.tv_usec) / 1000000.0, &rs, execd);
+			if(__SHOW_DETAILS__) {
+				printf("PID %d\t[%s] completed.\n", wait_pid, pargs[0]);
+				printMessage(&st, &en, &rs);
 			}
-			if(!strcmp(sargs[0], "pwd")) {
-				printWorkingDirectory();
-				continue;
+			printPerf(perf);
+			return exitStatus(child_status);
+		}
+	}
+}
+
+/**
+ * single pass lexer: splits line into arena->argv handling '..' and ".."
+ * quoting, backslash escapes, $NAME / ${NAME} / $? / $$ expansion and
+ * trailing '#' comments. words are written once into arena->buf and argv
+ * holds views into it. returns argc, or -1 on a syntax error.
+ **/
+int tokenize(char *line, Arena *a) {
+	long len = strlen(line), i = 0, j, vlen, start = 0;
+	int inword = 0, quoted = 0, lastq = 0;
+	char c, quote = 0, save, *v, num[16];
+
+	a->used = a->argc = a->background = 0;
+	reserve(a, len + 1);
+	while(i < len) {
+		c = line[i];
+		if(!quote && (c == ' ' || c == '\t' || c == '\n' || c == '\r')) {
+			if(inword) {
+				// an unquoted word that expanded to nothing is dropped
+				if(!quoted && a->used == start) a->argc--;
+				else a->buf[a->used++] = 0, lastq = quoted;
+				inword = 0;
 			}
-			if(!strcmp(sargs[0], "jobs")) {
-				showCompletedJobs(1);
-				continue;
+			i++;
+			continue;
+		}
+		if(!quote && !inword && c == '#') break;
+		if(!inword) {
+			start = a->used;
+			pushArg(a, a->buf + start);
+			inword = 1; quoted = 0;
+		}
+		if(quote == '\'') {
+			if(c == '\'') quote = 0;
+			else a->buf[a->used++] = c;
+			i++;
+		}
+		else if(c == '\'' || c == '"') {
+			quote = (quote ? 0 : c);
+			quoted = 1; i++;
+		}
+		else if(c == '\\') {
+			if(i+1 < len && (!quote || strchr("\"\\$`", line[i+1]))) i++;
+			a->buf[a->used++] = line[i++];
+			quoted = 1;
+		}
+		else if(c == '$' && i+1 < len) {
+			j = i + 1; v = NULL;
+			if(line[j] == '?' || line[j] == '$') {
+				sprintf(num, "%d", (line[j] == '?' ? __LAST_STATUS__ : (int) getpid()));
+				v = num; i = j + 1;
 			}
-			if(!strcmp(sargs[0], "@stats")) {
-				if(!strcmp(sargs[1], "on")) __SHOW_DETAILS__ = 1;
-				else if(!strcmp(sargs[1], "off")) __SHOW_DETAILS__ = 0;
-				else printf("Status display: %s\nOptions: [on/off]\n", (__SHOW_DETAILS__? "ON" : "OFF"));
+			else if(line[j] == '{' && (v = strchr(line + j, '}')) != NULL) {
+				save = *v; *v = 0;
+				i = v - line + 1;
+				v = getenv(line + j + 1);
+				line[i-1] = save;
+			}
+			else if(line[j] == '_' || (line[j] >= 'A' && line[j] <= 'Z') || (line[j] >= 'a' && line[j] <= 'z')) {
+				while(j < len && (line[j] == '_' || (line[j] >= 'A' && line[j] <= 'Z') || (line[j] >= 'a' && line[j] <= 'z') || (line[j] >= '0' && line[j] <= '9'))) j++;
+				save = line[j]; line[j] = 0;
+				v = getenv(line + i + 1);
+				line[j] = save;
+				i = j;
+			}
+			else {
+				a->buf[a->used++] = c; i++;
 				continue;
 			}
+			if(v) {
+				vlen = strlen(v);
+				reserve(a, a->used + vlen + (len - i) + 1);
+				memcpy(a->buf + a->used, v, vlen);
+				a->used += vlen;
+			}
+		}
+		else a->buf[a->used++] = line[i++];
+	}
+	if(quote) {
+		printf("mShell: unexpected EOF while looking for matching `%c'...\n", quote);
+		return -1;
+	}
+	if(inword) {
+		if(!quoted && a->used == start) a->argc--;
+		else a->buf[a->used++] = 0, lastq = quoted;
+	}
+	if(a->argc && !lastq && !strcmp(a->argv[a->argc-1], "&")) {
+		a->background = 1;
+		a->argc--;
+	}
+	pushArg(a, NULL);
+	a->argc--;
+	return a->argc;
+}
+
+void reserve(Arena *a, long need) {
+	char *tmp;
+	int i;
+	if(need <= a->cap) return;
+	if(!a->cap) a->cap = 256;
+	while(a->cap < need) a->cap <<= 1;
+	tmp = new char[a->cap];
+	if(a->buf) {
+		memcpy(tmp, a->buf, a->used);
+		for(i = 0; i < a->argc; i++) a->argv[i] = tmp + (a->argv[i] - a->buf);
+		delete [] a->buf;
+	}
+	a->buf = tmp;
+}
+
+void pushArg(Arena *a, char *arg) {
+	char **tmp;
+	if(a->argc + 1 > a->acap) {
+		a->acap = (a->acap ? a->acap << 1 : 32);
+		tmp = new char*[a->acap];
+		if(a->argv) {
+			memcpy(tmp, a->argv, a->argc * sizeof(char *));
+			delete [] a->argv;
+		}
+		a->argv = tmp;
+	}
+	a->argv[a->argc++] = arg;
+}
 
-			pid = fork();
+/**
+ * runs fn in the shell process itself; with @stats on, the usage
+ * reported is the difference in RUSAGE_SELF across the call
+ **/
+int runBuiltin(int (*fn)(int, char **), int argc, char **argv) {
+	timeval st, en;
+	rusage rb, ra;
+	int i, status, perf[PERF_EVENTS];
 
-			if(pid == -1) {
-				printf("mShell: system call fork() failed...\n");
-				exit(1);
+	for(i = 0; i < PERF_EVENTS; i++) perf[i] = -1;
+	if(__SHOW_DETAILS__ == 2) perfOpen(0, perf, 0);
+	gettimeofday(&st, NULL);
+	getrusage(RUSAGE_SELF, &rb);
+	for(i = 0; i < PERF_EVENTS; i++) if(perf[i] != -1) ioctl(perf[i], PERF_EVENT_IOC_ENABLE, 0);
+	status = fn(argc, argv);
+	for(i = 0; i < PERF_EVENTS; i++) if(perf[i] != -1) ioctl(perf[i], PERF_EVENT_IOC_DISABLE, 0);
+	getrusage(RUSAGE_SELF, &ra);
+	gettimeofday(&en, NULL);
+	timersub(&ra.ru_utime, &rb.ru_utime, &ra.ru_utime);
+	timersub(&ra.ru_stime, &rb.ru_stime, &ra.ru_stime);
+	recordCommand(argv[0], (en.tv_sec - st.tv_sec) + (en.tv_usec - st.tv_usec) / 1000000.0, &ra, 0);
+	if(__SHOW_DETAILS__) {
+		ra.ru_nvcsw -= rb.ru_nvcsw; ra.ru_nivcsw -= rb.ru_nivcsw;
+		ra.ru_minflt -= rb.ru_minflt; ra.ru_majflt -= rb.ru_majflt;
+		printf("PID %d\t[%s] completed.\n", getpid(), argv[0]);
+		printMessage(&st, &en, &ra);
+	}
+	printPerf(perf);
+	return status;
+}
+
+/**
+ * parses '@run' modifiers:
+ *   --cpus=LIST   pin to cpus, e.g. 2-5,7 (sched_setaffinity)
+ *   --nice=N      scheduling priority (setpriority)
+ *   --mem=SIZE    address space limit, K/M/G/T suffixes (setrlimit)
+ *   --cgroup[=DIR] run inside a new cgroup v2 leaf under DIR (default
+ *                 CGROUP_PARENT); --mem then also becomes its memory.max
+ * returns the number of words consumed (including '@run') or -1
+ **/
+int parseSched(int argc, char **argv, Sched *sc) {
+	int i;
+	char *e;
+	for(i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+		if(!strncmp(argv[i], "--cpus=", 7)) {
+			if(parseCpus(argv[i] + 7, &sc->cpus) == -1) {
+				printf("mShell: @run: %s: invalid cpu list...\n", argv[i] + 7);
+				return -1;
 			}
-			if(!pid) {
-				execvp(pargs[0], pargs);
-				printf("mShell: %s: command not found...\n", pargs[0]);
-				exit(2);
+			sc->ncpus = CPU_COUNT(&sc->cpus);
+		}
+		else if(!strncmp(argv[i], "--nice=", 7)) {
+			sc->nice = strtol(argv[i] + 7, &e, 10);
+			if(e == argv[i] + 7 || *e || sc->nice < -20 || sc->nice > 19) {
+				printf("mShell: @run: %s: nice must be in [-20, 19]...\n", argv[i] + 7);
+				return -1;
 			}
-			else {
-				if(background) {
-					memset(&b, 0, sizeof(Node));
-					b.pid = pid; strcpy(b.name, pargs[0]);
-					gettimeofday(&b.st, NULL); b.done = 1;
-					b.sl = 1 + __CURR_BCKGRND__;
-					add(b);
-					printf("[%d] %d\t[%s]\n", b.sl, pid, pargs[0]);
-				}
-				else {
-					gettimeofday(&st, NULL);
-					if((wait_pid = waitpid(pid, &child_status, 0)) == -1) {
-						printf("mShell: system call wait() failed...\n");
-						exit(4);
-					}
-					getrusage(RUSAGE_CHILDREN, &rs);
-					gettimeofday(&en, NULL);
-					if(__SHOW_DETAILS__) {
-						printf("PID %d\t[%s] completed.\n", wait_pid, pargs[0]);
-						printMessage(&st, &en, &rs);
-					}
-				}
+			sc->hasnice = 1;
+		}
+		else if(!strncmp(argv[i], "--mem=", 6)) {
+			if((sc->mem = parseSize(argv[i] + 6)) <= 0) {
+				printf("mShell: @run: %s: invalid size...\n", argv[i] + 6);
+				return -1;
+			}
+		}
+		else if(!strcmp(argv[i], "--cgroup")) sc->cgroup = 1;
+		else if(!strncmp(argv[i], "--cgroup=", 9)) {
+			sc->cgroup = 1;
+			if(snprintf(sc->cgpath, sizeof(sc->cgpath), "%s", argv[i] + 9) >= (int) sizeof(sc->cgpath)) {
+				printf("mShell: @run: cgroup path too long...\n");
+				return -1;
+			}
+		}
+		else if(!strcmp(argv[i], "--")) { i++; break; }
+		else {
+			printf("mShell: @run: %s: invalid option...\n", argv[i]);
+			return -1;
+		}
+	}
+	if(i == argc) {
+		printf("usage: @run [--cpus=LIST] [--nice=N] [--mem=SIZE] [--cgroup[=DIR]] command [args...] [&]\n");
+		return -1;
+	}
+	return i;
+}
+
+int parseCpus(char *s, cpu_set_t *set) {
+	long a, b;
+	char *e;
+	CPU_ZERO(set);
+	while(*s) {
+		a = b = strtol(s, &e, 10);
+		if(e == s || a < 0) return -1;
+		if(*e == '-') {
+			s = e + 1;
+			b = strtol(s, &e, 10);
+			if(e == s || b < a) return -1;
+		}
+		if(b >= CPU_SETSIZE) return -1;
+		for(; a <= b; a++) CPU_SET(a, set);
+		if(*e == ',') e++;
+		else if(*e) return -1;
+		s = e;
+	}
+	return (CPU_COUNT(set) ? 0 : -1);
+}
+
+// a byte count with an optional K/M/G/T suffix; -1 if invalid or too large
+long parseSize(char *s) {
+	static const char units[] = "KkMmGgTt";
+	const char *u;
+	char *e;
+	int shift = 0;
+	long n;
+	errno = 0;
+	n = strtol(s, &e, 10);
+	if(e == s || n < 0 || errno == ERANGE) return -1;
+	if(*e && (u = strchr(units, *e)) != NULL) {
+		shift = 10 * ((u - units) / 2 + 1);
+		e++;
+	}
+	if(*e || n > (LONG_MAX >> shift)) return -1;
+	return n << shift;
+}
+
+/**
+ * makes an empty leaf cgroup for the job; sc->cgpath holds the parent
+ * on entry (CGROUP_PARENT if empty, created on first use) and the leaf
+ * on return. with --mem the parent must hand the memory controller
+ * down, otherwise the job is refused rather than run unconstrained
+ **/
+int createCgroup(Sched *sc) {
+	static int seq = 0;
+	char parent[PATH_MAX], path[PATH_MAX], ctl[256], *p;
+	int on = 0;
+	FILE *fp;
+	struct statfs fs;
+
+	snprintf(parent, sizeof(parent), "%s", (sc->cgpath[0] ? sc->cgpath : CGROUP_PARENT));
+	sc->cgpath[0] = 0;
+	if(!strcmp(parent, CGROUP_PARENT)) {
+		if(statfs(CGROUP_ROOT, &fs) == -1 || fs.f_type != CGROUP2_MAGIC) {
+			printf("mShell: @run: %s: not a cgroup v2 hierarchy...\n", CGROUP_ROOT);
+			return -1;
+		}
+		if(mkdir(parent, 0755) == -1 && errno != EEXIST) {
+			printf("mShell: @run: %s: cannot create cgroup: %s...\n", parent, strerror(errno));
+			return -1;
+		}
+	}
+	if(statfs(parent, &fs) == -1 || fs.f_type != CGROUP2_MAGIC) {
+		printf("mShell: @run: %s: not a cgroup v2 hierarchy...\n", parent);
+		return -1;
+	}
+	if(sc->mem) {
+		if(snprintf(path, sizeof(path), "%s/cgroup.subtree_control", parent) >= (int) sizeof(path)) goto toolong;
+		if((fp = fopen(path, "r")) != NULL) {
+			if(fgets(ctl, sizeof(ctl), fp))
+				for(p = strtok(ctl, " \n"); p; p = strtok(NULL, " \n")) if(!strcmp(p, "memory")) on = 1;
+			fclose(fp);
+		}
+		if(!on && ((fp = fopen(path, "w")) == NULL || (fprintf(fp, "+memory\n") < 0) | (fclose(fp) == EOF))) {
+			printf("mShell: @run: %s: cannot enable the memory controller: %s...\n", parent, strerror(errno));
+			return -1;
+		}
+	}
+	if(snprintf(sc->cgpath, sizeof(sc->cgpath), "%s/mshell.%d.%d", parent, (int) getpid(), ++seq) >= (int) sizeof(sc->cgpath)) goto toolong;
+	if(mkdir(sc->cgpath, 0755) == -1) {
+		printf("mShell: @run: %s: cannot create cgroup: %s...\n", sc->cgpath, strerror(errno));
+		sc->cgpath[0] = 0;
+		return -1;
+	}
+	if(sc->mem) {
+		if(snprintf(path, sizeof(path), "%s/memory.max", sc->cgpath) >= (int) sizeof(path)
+			|| (fp = fopen(path, "w")) == NULL || (fprintf(fp, "%ld\n", sc->mem) < 0) | (fclose(fp) == EOF)) {
+			printf("mShell: @run: %s: cannot set memory.max: %s...\n", sc->cgpath, strerror(errno));
+			removeCgroup(sc->cgpath);
+			sc->cgpath[0] = 0;
+			return -1;
+		}
+	}
+	return 0;
+toolong:
+	printf("mShell: @run: %s: cgroup path too long...\n", parent);
+	sc->cgpath[0] = 0;
+	return -1;
+}
+
+void removeCgroup(char *path) {
+	if(path && path[0]) rmdir(path);
+}
+
+// runs in the child between fork() and exec(); returns -1 if the job must not run
+int applySched(Sched *sc) {
+	char procs[PATH_MAX + 16];
+	FILE *fp;
+	rlimit rl;
+	if(sc->cgpath[0]) {
+		snprintf(procs, sizeof(procs), "%s/cgroup.procs", sc->cgpath);
+		if((fp = fopen(procs, "w")) == NULL || fprintf(fp, "0\n") < 0 || fclose(fp) == EOF) {
+			perror("mShell: @run: cannot join cgroup");
+			return -1;
+		}
+	}
+	if(sc->ncpus && sched_setaffinity(0, sizeof(cpu_set_t), &sc->cpus) == -1) {
+		perror("mShell: @run: sched_setaffinity");
+		return -1;
+	}
+	if(sc->hasnice && setpriority(PRIO_PROCESS, 0, sc->nice) == -1) {
+		perror("mShell: @run: setpriority");
+		return -1;
+	}
+	if(sc->mem) {
+		rl.rlim_cur = rl.rlim_max = sc->mem;
+		if(setrlimit(RLIMIT_AS, &rl) == -1) {
+			perror("mShell: @run: setrlimit");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void formatCpus(cpu_set_t *set, char *buf, int len) {
+	int i, j, n = 0;
+	buf[0] = 0;
+	for(i = 0; i < CPU_SETSIZE && n < len; i = j) {
+		if(!CPU_ISSET(i, set)) { j = i + 1; continue; }
+		for(j = i; j < CPU_SETSIZE && CPU_ISSET(j, set); j++);
+		if(j - 1 == i) n += snprintf(buf + n, len - n, "%s%d", (n ? "," : ""), i);
+		else n += snprintf(buf + n, len - n, "%s%d-%d", (n ? "," : ""), i, j - 1);
+	}
+}
+
+/**
+ * prints where a running job actually is and what it has used so far,
+ * queried from the kernel rather than from what '@run' asked for
+ **/
+void showPlacement(Node *n) {
+	char path[PATH_MAX + 16], buf[1024], cpus[128], *p;
+	long tck = sysconf(_SC_CLK_TCK), pg = sysconf(_SC_PAGESIZE);
+	unsigned long ut = 0, st = 0;
+	long rss = 0, mem = -1;
+	int len;
+	FILE *fp;
+	cpu_set_t set;
+	rlimit rl;
+
+	if(sched_getaffinity(n->pid, sizeof(cpu_set_t), &set) == -1) return;
+	formatCpus(&set, cpus, sizeof(cpus));
+	printf("\tcpus=%s nice=%d", cpus, getpriority(PRIO_PROCESS, n->pid));
+	if(prlimit(n->pid, RLIMIT_AS, NULL, &rl) == 0) {
+		if(rl.rlim_cur == RLIM_INFINITY) printf(" mem=unlimited");
+		else printf(" mem=%ldK", (long) (rl.rlim_cur >> 10));
+	}
+	snprintf(path, sizeof(path), "/proc/%d/stat", n->pid);
+	if((fp = fopen(path, "r")) != NULL) {
+		len = fread(buf, 1, sizeof(buf) - 1, fp);
+		buf[len] = 0;
+		fclose(fp);
+		// fields after the ')' of comm: state is field 3, utime 14, stime 15, rss 24
+		if((p = strrchr(buf, ')')) != NULL)
+			sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld", &ut, &st, &rss);
+	}
+	printf(" rss=%ldK user=%.3lf(ms) system=%.3lf(ms)", rss * pg >> 10, ut * 1000.0 / tck, st * 1000.0 / tck);
+	if(n->cgpath[0]) {
+		snprintf(path, sizeof(path), "%s/memory.current", n->cgpath);
+		if((fp = fopen(path, "r")) != NULL) {
+			if(fscanf(fp, "%ld", &mem) != 1) mem = -1;
+			fclose(fp);
+		}
+		printf("\n\tcgroup=%s", n->cgpath);
+		if(mem >= 0) printf(" memory.current=%ldK", mem >> 10);
+	}
+	printf("\n");
+}
+
+/**
+ * @bench [-n N] [--warmup W] [--rate R] [-q] [--csv | --json] command [args...]
+ * runs command W + N times back to back (or started R times a second),
+ * timing each run with the monotonic clock and taking its own usage
+ * from wait4(). warmup runs are not recorded. -q sends the command's
+ * stdout to /dev/null.
+ **/
+int benchmark(int argc, char **argv) {
+	int i, k, n = 10, warm = 0, out = 1, fmt = BENCH_TEXT, status = 0;
+	long maxrss = 0, rate = 0;
+	double *wall, *user, *sys, *rss, *vcs, *ivcs, tv, ts;
+	char *e;
+	rusage ru;
+	timespec next;
+
+	for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if(!strcmp(argv[i], "-n") && i+1 < argc) n = strtol(argv[++i], &e, 10);
+		else if(!strcmp(argv[i], "--warmup") && i+1 < argc) warm = strtol(argv[++i], &e, 10);
+		else if(!strcmp(argv[i], "--rate") && i+1 < argc) rate = strtol(argv[++i], &e, 10);
+		else if(!strcmp(argv[i], "-q")) { out = 0; continue; }
+		else if(!strcmp(argv[i], "--csv")) { fmt = BENCH_CSV; continue; }
+		else if(!strcmp(argv[i], "--json")) { fmt = BENCH_JSON; continue; }
+		else if(!strcmp(argv[i], "--")) { i++; break; }
+		else break;
+		// a bad number must not be taken for the command
+		if(e == argv[i] || *e || n < 1 || warm < 0 || rate < 0) goto usage;
+	}
+	if(i >= argc || argv[i][0] == '-') {
+usage:
+		printf("usage: @bench [-n N] [--warmup W] [--rate R] [-q] [--csv | --json] command [args...]\n");
+		return 2;
+	}
+	argv += i;
+	if(!out && (out = open("/dev/null", O_WRONLY | O_CLOEXEC)) == -1) out = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for(k = 0; k < warm; k++) {
+		pace(&next, rate);
+		if((status = benchRun(argv, out, &tv, &ru)) != 0) {
+			printf("mShell: @bench: warmup run %d of [%s] exited with status %d...\n", k+1, argv[0], status);
+			if(out != 1) close(out);
+			return status;
+		}
+	}
+	wall = new double[6 * n];
+	user = wall + n; sys = user + n; rss = sys + n; vcs = rss + n; ivcs = vcs + n;
+	for(k = 0; k < n; k++) {
+		pace(&next, rate);
+		if((status = benchRun(argv, out, &wall[k], &ru)) != 0) {
+			printf("mShell: @bench: run %d of [%s] exited with status %d...\n", k+1, argv[0], status);
+			break;
+		}
+		user[k] = (ru.ru_utime.tv_sec * 1000000.0 + ru.ru_utime.tv_usec) / 1000.0;
+		sys[k] = (ru.ru_stime.tv_sec * 1000000.0 + ru.ru_stime.tv_usec) / 1000.0;
+		rss[k] = ru.ru_maxrss;
+		vcs[k] = ru.ru_nvcsw;
+		ivcs[k] = ru.ru_nivcsw;
+		if(ru.ru_maxrss > maxrss) maxrss = ru.ru_maxrss;
+		if(fmt == BENCH_CSV) {
+			if(!k) printf("run,wall_ms,user_ms,sys_ms,maxrss_kb,nvcsw,nivcsw\n");
+			printf("%d,%.3lf,%.3lf,%.3lf,%ld,%ld,%ld\n", k+1, wall[k], user[k], sys[k], ru.ru_maxrss, ru.ru_nvcsw, ru.ru_nivcsw);
+		}
+	}
+	if(!status && fmt != BENCH_CSV) {
+		for(tv = ts = 0, k = 0; k < n; k++) tv += vcs[k], ts += ivcs[k];
+		qsort(wall, n, sizeof(double), dblcomp);
+		qsort(user, n, sizeof(double), dblcomp);
+		qsort(sys, n, sizeof(double), dblcomp);
+		qsort(rss, n, sizeof(double), dblcomp);
+		if(fmt == BENCH_JSON) {
+			printf("{\"command\": \"");
+			for(e = argv[0]; *e; e++) {
+				if(*e == '"' || *e == '\\') printf("\\%c", *e);
+				else if((unsigned char) *e >= ' ') printf("%c", *e);
+			}
+			printf("\", \"runs\": %d, \"warmup\": %d, \"rate\": %ld", n, warm, rate);
+			printRow("wall_ms", wall, n, BENCH_JSON);
+			printRow("user_ms", user, n, BENCH_JSON);
+			printRow("sys_ms", sys, n, BENCH_JSON);
+			printf(", \"maxrss_kb\": {\"median\": %.0lf, \"max\": %ld}", percentile(rss, n, 50), maxrss);
+			printf(", \"nvcsw_mean\": %.2lf, \"nivcsw_mean\": %.2lf}\n", tv / n, ts / n);
+		}
+		else {
+			if(rate) printf("\n---Benchmark [%s]: %d runs, %d warmup, %ld/s---\n", argv[0], n, warm, rate);
+			else printf("\n---Benchmark [%s]: %d runs, %d warmup---\n", argv[0], n, warm);
+			printf("%-10s %10s %10s %10s %10s %10s\n", "", "min", "median", "p90", "p99", "max");
+			printRow("wall(ms)", wall, n, BENCH_TEXT);
+			printRow("user(ms)", user, n, BENCH_TEXT);
+			printRow("sys(ms)", sys, n, BENCH_TEXT);
+			printf("max rss = %ld(KB); median max rss = %.0lf(KB)\n", maxrss, percentile(rss, n, 50));
+			printf("voluntary context switches = %.2lf/run; involuntary context switches = %.2lf/run\n", tv / n, ts / n);
+			printf("------------------------\n");
+		}
+	}
+	delete [] wall;
+	if(out != 1) close(out);
+	return status;
+}
+
+// with rate > 0, sleeps until *next and schedules the following start
+void pace(timespec *next, long rate) {
+	if(rate <= 0) return;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR);
+	next->tv_nsec += 1000000000L / rate;
+	next->tv_sec += next->tv_nsec / 1000000000L;
+	next->tv_nsec %= 1000000000L;
+}
+
+/**
+ * one timed run of argv with its stdout on fd out; returns the exit
+ * status, *ms and *ru describe the run. uses the zygote when enabled.
+ **/
+int benchRun(char **argv, int out, double *ms, rusage *ru) {
+	timespec st, en;
+	pid_t pid;
+	int n, status, execd = 1, ep[2], fds[3] = { 0, out, 2 };
+
+	fflush(stdout);
+	if(__METRICS_FD__ == -1 || pipe2(ep, O_CLOEXEC) == -1) ep[0] = ep[1] = -1;
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	if(__ZYGOTE_FD__ != -1 && (pid = zygoteSpawn(argv, fds)) > 0) {
+		if(ep[0] != -1) { close(ep[0]); close(ep[1]); }
+		clock_gettime(CLOCK_MONOTONIC, &en);
+		recordSpawn((en.tv_sec - st.tv_sec) + (en.tv_nsec - st.tv_nsec) / 1000000000.0);
+		if(zygoteWait(pid, &status, ru) == -1) return 1;
+	}
+	else {
+		if((pid = fork()) == -1) {
+			printf("mShell: system call fork() failed...\n");
+			if(__METRICS_FD__ != -1) counters.forkfail++;
+			if(ep[0] != -1) { close(ep[0]); close(ep[1]); }
+			return 1;
+		}
+		if(!pid) {
+			if(out != 1) dup2(out, 1);
+			execvp(argv[0], argv);
+			if(ep[1] != -1) write(ep[1], &errno, sizeof(int));
+			printf("mShell: %s: command not found...\n", argv[0]);
+			exit(2);
+		}
+		if(ep[0] != -1) {
+			close(ep[1]);
+			while((n = read(ep[0], &status, sizeof(int))) == -1 && errno == EINTR);
+			close(ep[0]);
+			clock_gettime(CLOCK_MONOTONIC, &en);
+			if(n > 0) counters.execfail++, execd = 0;
+			else recordSpawn((en.tv_sec - st.tv_sec) + (en.tv_nsec - st.tv_nsec) / 1000000000.0);
+		}
+		waitForeground(pid, &status, ru);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &en);
+	*ms = (en.tv_sec - st.tv_sec) * 1000.0 + (en.tv_nsec - st.tv_nsec) / 1000000.0;
+	recordCommand(argv[0], *ms / 1000.0, ru, execd);
+	return exitStatus(status);
+}
+
+int dblcomp(const void *a, const void *b) {
+	double x = *(double *)a, y = *(double *)b;
+	return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of an ascending array
+double percentile(double *v, int n, double p) {
+	int k = (int) ceil(p / 100.0 * n) - 1;
+	if(k < 0) k = 0;
+	if(k >= n) k = n - 1;
+	return v[k];
+}
+
+void printRow(const char *name, double *v, int n, int fmt) {
+	if(fmt == BENCH_JSON) {
+		printf(", \"%s\": {\"min\": %.3lf, \"median\": %.3lf, \"p90\": %.3lf, \"p99\": %.3lf, \"max\": %.3lf}", name, v[0], percentile(v, n, 50), percentile(v, n, 90), percentile(v, n, 99), v[n-1]);
+	}
+	else printf("%-10s %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf\n", name, v[0], percentile(v, n, 50), percentile(v, n, 90), percentile(v, n, 99), v[n-1]);
+}
+
+/**
+ * starts a helper that stays resident and launches commands on behalf of
+ * the shell: each request makes it vfork a worker which takes over the
+ * given argv, cwd, environ and stdio and execs, so the shell itself never
+ * has to fork. the helper waits for the worker and reports back.
+ * it is a fresh exec of /proc/self/exe, so it carries none of the heap
+ * the shell has built up; only if that exec fails does the plain fork
+ * of the shell serve as the helper.
+ **/
+int zygoteStart() {
+	int sv[2];
+	pid_t pid;
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("mShell: @zygote: socketpair");
+		return 1;
+	}
+	fflush(stdout);
+	if((pid = fork()) == -1) {
+		printf("mShell: system call fork() failed...\n");
+		close(sv[0]); close(sv[1]);
+		return 1;
+	}
+	if(!pid) {
+		close(sv[0]);
+		if(dup2(sv[1], ZYGOTE_SOCK) != -1) execl("/proc/self/exe", "mshell", "--zygote", (char *) NULL);
+		zygoteLoop(sv[1]);
+		_exit(0);
+	}
+	close(sv[1]);
+	__ZYGOTE_FD__ = sv[0];
+	__ZYGOTE_PID__ = pid;
+	return 0;
+}
+
+void zygoteStop() {
+	if(__ZYGOTE_FD__ == -1) return;
+	close(__ZYGOTE_FD__);
+	while(waitpid(__ZYGOTE_PID__, NULL, 0) == -1 && errno == EINTR);
+	__ZYGOTE_FD__ = -1;
+	__ZYGOTE_PID__ = 0;
+}
+
+void zygoteLoop(int sock) {
+	ZygoteMsg msg;
+	msghdr mh;
+	iovec iov;
+	cmsghdr *cm;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))], *buf = NULL, *p, **av = NULL, **ev = NULL;
+	long cap = 0, vcap = 0;
+	int fds[3], i, k, status;
+	pid_t pid;
+
+	signal(SIGCHLD, SIG_DFL);
+	while(1) {
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = &msg; iov.iov_len = sizeof(msg);
+		mh.msg_iov = &iov; mh.msg_iovlen = 1;
+		mh.msg_control = cbuf; mh.msg_controllen = sizeof(cbuf);
+		if((k = recvmsg(sock, &mh, 0)) <= 0) {
+			if(k == -1 && errno == EINTR) continue;
+			break;
+		}
+		if(k < (int) sizeof(msg) && readFull(sock, (char *) &msg + k, sizeof(msg) - k) == -1) break;
+		if((cm = CMSG_FIRSTHDR(&mh)) == NULL || cm->cmsg_type != SCM_RIGHTS) break;
+		memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+		if(msg.len + 1 > cap) {
+			delete [] buf;
+			buf = new char[cap = msg.len + 1];
+		}
+		if(msg.argc + msg.envc + 2 > vcap) {
+			delete [] av;
+			vcap = msg.argc + msg.envc + 2;
+			av = new char*[vcap];
+		}
+		if(readFull(sock, buf, msg.len) == -1) break;
+		ev = av + msg.argc + 1;
+		p = buf + strlen(buf) + 1;
+		for(i = 0; i < msg.argc; i++, p += strlen(p) + 1) av[i] = p;
+		av[i] = NULL;
+		for(i = 0; i < msg.envc; i++, p += strlen(p) + 1) ev[i] = p;
+		ev[i] = NULL;
+
+		pid = zygoteWorker(sock, buf, av, ev, fds);
+		for(i = 0; i < 3; i++) close(fds[i]);
+		msg.type = ZYGOTE_STARTED;
+		msg.pid = (pid == -1 ? -errno : pid);
+		if(writeFull(sock, &msg, sizeof(msg)) == -1 || pid == -1) continue;
+		while(wait4(pid, &status, 0, &msg.ru) == -1 && errno == EINTR);
+		msg.type = ZYGOTE_EXITED;
+		msg.status = status;
+		writeFull(sock, &msg, sizeof(msg));
+	}
+	close(sock);
+}
+
+/**
+ * vforks the worker for one request; it shares our memory until it
+ * execs, so it only touches its own fds and stack and leaves through
+ * _exit(). kept out of zygoteLoop() so none of the loop's state is live
+ * across the vfork
+ **/
+pid_t zygoteWorker(int sock, char *cwd, char **av, char **ev, int *fds) {
+	char err[256];
+	int i, k;
+	pid_t pid;
+	if((pid = vfork()) == 0) {
+		close(sock);
+		for(i = 0; i < 3; i++) if(fds[i] != i) dup2(fds[i], i);
+		for(i = 0; i < 3; i++) if(fds[i] > 2) close(fds[i]);
+		if(chdir(cwd) == -1) {
+			k = snprintf(err, sizeof(err), "mShell: %s: %s...\n", cwd, strerror(errno));
+			write(2, err, (k < (int) sizeof(err) ? k : sizeof(err) - 1));
+			_exit(126);
+		}
+		execvpe(av[0], av, ev);
+		k = snprintf(err, sizeof(err), "mShell: %s: command not found...\n", av[0]);
+		write(1, err, (k < (int) sizeof(err) ? k : sizeof(err) - 1));
+		_exit(2);
+	}
+	return pid;
+}
+
+/**
+ * hands argv, cwd, environ and fds[0..2] to the zygote; returns the
+ * worker's pid or -1 after turning the zygote off if it is unusable
+ **/
+pid_t zygoteSpawn(char **argv, int *fds) {
+	ZygoteMsg msg;
+	msghdr mh;
+	iovec iov[2];
+	cmsghdr *cm;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))], cwd[4096];
+	static char *buf = NULL;
+	static long cap = 0;
+	long len;
+	int i;
+
+	if(getcwd(cwd, sizeof(cwd)) == NULL) return -1;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = ZYGOTE_SPAWN;
+	msg.len = strlen(cwd) + 1;
+	for(i = 0; argv[i]; i++) msg.len += strlen(argv[i]) + 1;
+	msg.argc = i;
+	for(i = 0; environ[i]; i++) msg.len += strlen(environ[i]) + 1;
+	msg.envc = i;
+	if(msg.len > cap) {
+		delete [] buf;
+		buf = new char[cap = msg.len];
+	}
+	len = strlen(cwd) + 1;
+	memcpy(buf, cwd, len);
+	for(i = 0; argv[i]; i++) {
+		memcpy(buf + len, argv[i], strlen(argv[i]) + 1);
+		len += strlen(argv[i]) + 1;
+	}
+	for(i = 0; environ[i]; i++) {
+		memcpy(buf + len, environ[i], strlen(environ[i]) + 1);
+		len += strlen(environ[i]) + 1;
+	}
+
+	memset(&mh, 0, sizeof(mh));
+	iov[0].iov_base = &msg; iov[0].iov_len = sizeof(msg);
+	mh.msg_iov = iov; mh.msg_iovlen = 1;
+	mh.msg_control = cbuf; mh.msg_controllen = sizeof(cbuf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, 3 * sizeof(int));
+	while((len = sendmsg(__ZYGOTE_FD__, &mh, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+	if(len == -1 || (len < (long) sizeof(msg) && writeFull(__ZYGOTE_FD__, (char *) &msg + len, sizeof(msg) - len) == -1)
+		|| writeFull(__ZYGOTE_FD__, buf, msg.len) == -1 || readFull(__ZYGOTE_FD__, &msg, sizeof(msg)) == -1) {
+		printf("mShell: zygote is gone, falling back to fork()...\n");
+		zygoteStop();
+		return -1;
+	}
+	if(msg.pid < 0) {
+		errno = -msg.pid;
+		perror("mShell: zygote: fork");
+		return -1;
+	}
+	return msg.pid;
+}
+
+// blocks until the zygote reports that worker pid has exited
+int zygoteWait(pid_t pid, int *status, rusage *ru) {
+	ZygoteMsg msg;
+	waitEvents(__ZYGOTE_FD__, 0);
+	if(readFull(__ZYGOTE_FD__, &msg, sizeof(msg)) == -1 || msg.type != ZYGOTE_EXITED || msg.pid != pid) {
+		printf("mShell: zygote is gone, status of PID %d unknown...\n", pid);
+		zygoteStop();
+		return -1;
+	}
+	*status = msg.status;
+	*ru = msg.ru;
+	return 0;
+}
+
+int readFull(int fd, void *buf, long n) {
+	long r;
+	char *p = (char *) buf;
+	while(n > 0) {
+		if((r = read(fd, p, n)) == -1 && errno == EINTR) continue;
+		if(r <= 0) return -1;
+		p += r; n -= r;
+	}
+	return 0;
+}
+
+int writeFull(int fd, void *buf, long n) {
+	long r;
+	char *p = (char *) buf;
+	while(n > 0) {
+		if((r = send(fd, p, n, MSG_NOSIGNAL)) == -1 && errno == EINTR) continue;
+		if(r <= 0) return -1;
+		p += r; n -= r;
+	}
+	return 0;
+}
+
+void showPrompt() {
+	char temp[NAME_MAX + 1];
+	getCurrentDirectory(temp);
+	printf("mShell [%s]$ ", temp);
+	fflush(stdout);
+}
+
+// empties the notification pipe; returns non-zero if anything was in it
+int drainNotify() {
+	char buf[64];
+	int got = 0;
+	if(__NOTIFY_PIPE__[0] == -1) return 0;
+	while(read(__NOTIFY_PIPE__[0], buf, sizeof(buf)) > 0) got = 1;
+	return got;
+}
+
+/**
+ * blocks until fd is readable, or with fd == -1 until a child exits.
+ * background jobs finishing meanwhile are reported (and their hooks run)
+ * right away, and telemetry scrapes are answered while we wait.
+ **/
+int waitEvents(int fd, int prompt) {
+	pollfd pfd[3];
+	int i, n;
+	while(1) {
+		n = 0;
+		if(fd != -1) { pfd[n].fd = fd; pfd[n++].events = POLLIN; }
+		if(__NOTIFY_PIPE__[0] != -1) { pfd[n].fd = __NOTIFY_PIPE__[0]; pfd[n++].events = POLLIN; }
+		if(__METRICS_FD__ != -1) { pfd[n].fd = __METRICS_FD__; pfd[n++].events = POLLIN; }
+		for(i = 0; i < n; i++) pfd[i].revents = 0;
+		if(!n || poll(pfd, n, -1) == -1) {
+			if(n && errno == EINTR) continue;
+			return -1;
+		}
+		for(i = 0; i < n; i++) {
+			if(!pfd[i].revents) continue;
+			if(pfd[i].fd == __METRICS_FD__) metricsServe();
+			else if(pfd[i].fd == __NOTIFY_PIPE__[0]) {
+				if(drainNotify() && showCompletedJobs(0) && prompt && __INTERACTIVE__) showPrompt();
+				if(fd == -1) return 0;
 			}
+			else return 0;
+		}
+	}
+}
+
+// wait4() for a foreground child that keeps serving events meanwhile
+pid_t waitForeground(pid_t pid, int *status, rusage *ru) {
+	pid_t r;
+	while(1) {
+		if((r = wait4(pid, status, (__NOTIFY_PIPE__[0] == -1 ? 0 : WNOHANG), ru)) != 0) {
+			if(r == -1 && errno == EINTR) continue;
+			return r;
+		}
+		waitEvents(-1, 0);
+	}
+}
+
+/**
+ * @on-complete [command [args...] | --fifo=PATH | off]
+ * command runs detached for every finished background job with
+ * MSHELL_JOB_ID, MSHELL_JOB_PID, MSHELL_JOB_NAME, MSHELL_JOB_STATUS and
+ * MSHELL_JOB_WALL_MS set; --fifo writes "id pid name status wall_ms"
+ * lines to PATH instead, dropping them if no reader has it open
+ **/
+int setHook(int argc, char **argv) {
+	int i;
+	long len;
+	char *p;
+	if(argc == 1) {
+		if(__HOOK_FIFO__) printf("Completion hook: fifo %s\n", __HOOK_FIFO__);
+		else if(__HOOK_ARGV__) printf("Completion hook: %s\n", __HOOK_ARGV__[0]);
+		else printf("Completion hook: OFF\n");
+		printf("Options: [command [args...] / --fifo=PATH / off]\n");
+		return 0;
+	}
+	delete [] __HOOK_ARGV__; __HOOK_ARGV__ = NULL;
+	delete [] __HOOK_FIFO__; __HOOK_FIFO__ = NULL;
+	if(argc == 2 && !strcmp(argv[1], "off")) return 0;
+	if(!strncmp(argv[1], "--fifo=", 7)) {
+		__HOOK_FIFO__ = new char[strlen(argv[1] + 7) + 1];
+		strcpy(__HOOK_FIFO__, argv[1] + 7);
+		return 0;
+	}
+	// argv and its strings live in one block so a single delete frees them
+	for(len = 0, i = 1; i < argc; i++) len += strlen(argv[i]) + 1;
+	__HOOK_ARGV__ = (char **) new char[argc * sizeof(char *) + len];
+	p = (char *) (__HOOK_ARGV__ + argc);
+	for(i = 1; i < argc; i++, p += strlen(p) + 1) {
+		strcpy(p, argv[i]);
+		__HOOK_ARGV__[i-1] = p;
+	}
+	__HOOK_ARGV__[i-1] = NULL;
+	return 0;
+}
+
+void runHook(Node *n) {
+	char buf[256];
+	double ms = (n->en.tv_sec - n->st.tv_sec) * 1000.0 + (n->en.tv_usec - n->st.tv_usec) / 1000.0;
+	int fd, len;
+	pid_t pid;
+	if(__HOOK_FIFO__) {
+		len = snprintf(buf, sizeof(buf), "%d %d %s %d %.3lf\n", n->sl, n->pid, n->name, n->status, ms);
+		if((fd = open(__HOOK_FIFO__, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) != -1) {
+			write(fd, buf, (len < (int) sizeof(buf) ? len : sizeof(buf) - 1));
+			close(fd);
 		}
 	}
-	
+	if(!__HOOK_ARGV__) return;
+	// double fork so the hook never has to be reaped by the shell
+	if((pid = fork()) == 0) {
+		if(fork() == 0) {
+			sigset_t mask;
+			// we're called with SIGCHLD blocked and the shell ignores SIGINT;
+			// neither should leak into the hook across exec
+			sigemptyset(&mask);
+			sigprocmask(SIG_SETMASK, &mask, NULL);
+			signal(SIGINT, SIG_DFL);
+			sprintf(buf, "%d", n->sl); setenv("MSHELL_JOB_ID", buf, 1);
+			sprintf(buf, "%d", n->pid); setenv("MSHELL_JOB_PID", buf, 1);
+			sprintf(buf, "%d", n->status); setenv("MSHELL_JOB_STATUS", buf, 1);
+			sprintf(buf, "%.3lf", ms); setenv("MSHELL_JOB_WALL_MS", buf, 1);
+			setenv("MSHELL_JOB_NAME", n->name, 1);
+			execvp(__HOOK_ARGV__[0], __HOOK_ARGV__);
+			printf("mShell: @on-complete: %s: command not found...\n", __HOOK_ARGV__[0]);
+			fflush(stdout);
+		}
+		_exit(0);
+	}
+	if(pid > 0) while(waitpid(pid, NULL, 0) == -1 && errno == EINTR);
+}
+
+/**
+ * @metrics on [PATH] [--json] | off
+ * starts collecting telemetry and serves a snapshot of it, in Prometheus
+ * text format (or JSON), to every client connecting to the Unix socket at
+ * PATH (default $XDG_RUNTIME_DIR or /tmp, mshell-<pid>.sock). clients are
+ * answered from the shell's own wait loops, so no thread is needed.
+ **/
+int metricsStart(char *path, int json) {
+	sockaddr_un addr;
+	char *dir = getenv("XDG_RUNTIME_DIR");
+	int fd, n;
+	struct stat sb;
+	Metric *m;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(path) n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	else n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/mshell-%d.sock", (dir ? dir : "/tmp"), (int) getpid());
+	if(n >= (int) sizeof(addr.sun_path)) {
+		printf("mShell: @metrics: socket path longer than %d characters...\n", (int) sizeof(addr.sun_path) - 1);
+		return 1;
+	}
+	// only a stale socket may be replaced, never a file someone cares about
+	if(lstat(addr.sun_path, &sb) == 0) {
+		if(!S_ISSOCK(sb.st_mode)) {
+			printf("mShell: @metrics: %s: exists and is not a socket...\n", addr.sun_path);
+			return 1;
+		}
+		unlink(addr.sun_path);
+	}
+	if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) == -1) {
+		perror("mShell: @metrics: socket");
+		return 1;
+	}
+	if(bind(fd, (sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 16) == -1) {
+		printf("mShell: @metrics: %s: ", addr.sun_path);
+		fflush(stdout);
+		perror("cannot listen");
+		close(fd);
+		return 1;
+	}
+	while(metrics) {
+		m = metrics;
+		metrics = metrics->next;
+		delete m;
+	}
+	memset(&counters, 0, sizeof(counters));
+	strcpy(__METRICS_PATH__, addr.sun_path);
+	__METRICS_FD__ = fd;
+	__METRICS_JSON__ = json;
+	if(!__METRICS_OWNER__) atexit(metricsStop);
+	__METRICS_OWNER__ = getpid();
+	printf("Telemetry: serving on %s\n", __METRICS_PATH__);
 	return 0;
 }
 
+void metricsStop() {
+	// forked children exit through here as well, the socket isn't theirs
+	if(__METRICS_FD__ == -1 || getpid() != __METRICS_OWNER__) return;
+	close(__METRICS_FD__);
+	unlink(__METRICS_PATH__);
+	__METRICS_FD__ = -1;
+}
+
+void recordSpawn(double sec) {
+	if(__METRICS_FD__ == -1) return;
+	counters.spawned++;
+	counters.spawnsum += sec;
+	counters.spawnb[bucketOf(spawnBounds, SPAWN_BUCKETS, sec)]++;
+}
+
+/**
+ * adds one finished command to the per-name histograms; only real child
+ * processes that got through exec count as completed jobs, so that the
+ * completed total stays comparable to the spawned total
+ **/
+void recordCommand(char *name, double sec, rusage *ru, int child) {
+	Metric *m;
+	if(__METRICS_FD__ == -1) return;
+	for(m = metrics; m && strcmp(m->name, name); m = m->next);
+	if(!m) {
+		m = new Metric;
+		memset(m, 0, sizeof(Metric));
+		strncpy(m->name, name, 127);
+		m->next = metrics;
+		metrics = m;
+	}
+	if(child) counters.completed++;
+	m->count++;
+	m->buckets[bucketOf(wallBounds, WALL_BUCKETS, sec)]++;
+	m->wall += sec;
+	m->user += ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1000000.0;
+	m->sys += ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1000000.0;
+}
+
+int bucketOf(double *bounds, int n, double v) {
+	int i;
+	for(i = 0; i < n && v > bounds[i]; i++);
+	return i;
+}
+
+void appendf(char **buf, long *len, long *cap, const char *fmt, ...) {
+	va_list ap;
+	long n;
+	char *tmp;
+	while(1) {
+		va_start(ap, fmt);
+		n = vsnprintf(*buf + *len, *cap - *len, fmt, ap);
+		va_end(ap);
+		if(*len + n < *cap) break;
+		*cap = (*cap + n) << 1;
+		tmp = new char[*cap];
+		memcpy(tmp, *buf, *len);
+		delete [] *buf;
+		*buf = tmp;
+	}
+	*len += n;
+}
+
+// a command name as a quoted Prometheus label value / JSON string
+void appendLabel(char **buf, long *len, long *cap, char *s) {
+	appendf(buf, len, cap, "\"");
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\') appendf(buf, len, cap, "\\%c", *s);
+		else if(*s == '\n') appendf(buf, len, cap, "\\n");
+		else if((unsigned char) *s >= ' ') appendf(buf, len, cap, "%c", *s);
+	}
+	appendf(buf, len, cap, "\"");
+}
+
+// answers every pending client with one snapshot and hangs up
+void metricsServe() {
+	static char *buf = NULL;
+	static long cap = 0;
+	long len, cum;
+	int fd, i, live = 0;
+	Node *n;
+	Metric *m;
+
+	if(!buf) buf = new char[cap = 4096];
+	while((fd = accept4(__METRICS_FD__, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+		len = 0;
+		for(n = head; n; n = n->next) if(n->done) live++;
+		if(__METRICS_JSON__) {
+			appendf(&buf, &len, &cap, "{\"jobs_spawned\": %ld, \"jobs_completed\": %ld, \"fork_failures\": %ld, \"exec_failures\": %ld, \"background_jobs\": %d", counters.spawned, counters.completed, counters.forkfail, counters.execfail, live);
+			appendf(&buf, &len, &cap, ", \"spawn_latency_seconds\": {\"count\": %ld, \"sum\": %.6lf, \"buckets\": [", counters.spawned, counters.spawnsum);
+			for(i = 0; i <= SPAWN_BUCKETS; i++) appendf(&buf, &len, &cap, "%s%ld", (i ? ", " : ""), counters.spawnb[i]);
+			appendf(&buf, &len, &cap, "]}, \"commands\": {");
+			for(m = metrics; m; m = m->next) {
+				appendf(&buf, &len, &cap, "%s", (m == metrics ? "" : ", "));
+				appendLabel(&buf, &len, &cap, m->name);
+				appendf(&buf, &len, &cap, ": {\"count\": %ld, \"wall_seconds\": %.6lf, \"user_seconds\": %.6lf, \"sys_seconds\": %.6lf, \"wall_buckets\": [", m->count, m->wall, m->user, m->sys);
+				for(i = 0; i <= WALL_BUCKETS; i++) appendf(&buf, &len, &cap, "%s%ld", (i ? ", " : ""), m->buckets[i]);
+				appendf(&buf, &len, &cap, "]}");
+			}
+			appendf(&buf, &len, &cap, "}}\n");
+		}
+		else {
+			appendf(&buf, &len, &cap, "# TYPE mshell_jobs_spawned_total counter\nmshell_jobs_spawned_total %ld\n", counters.spawned);
+			appendf(&buf, &len, &cap, "# TYPE mshell_jobs_completed_total counter\nmshell_jobs_completed_total %ld\n", counters.completed);
+			appendf(&buf, &len, &cap, "# TYPE mshell_fork_failures_total counter\nmshell_fork_failures_total %ld\n", counters.forkfail);
+			appendf(&buf, &len, &cap, "# TYPE mshell_exec_failures_total counter\nmshell_exec_failures_total %ld\n", counters.execfail);
+			appendf(&buf, &len, &cap, "# TYPE mshell_background_jobs gauge\nmshell_background_jobs %d\n", live);
+			appendf(&buf, &len, &cap, "# TYPE mshell_spawn_latency_seconds histogram\n");
+			for(cum = i = 0; i < SPAWN_BUCKETS; i++) {
+				cum += counters.spawnb[i];
+				appendf(&buf, &len, &cap, "mshell_spawn_latency_seconds_bucket{le=\"%g\"} %ld\n", spawnBounds[i], cum);
+			}
+			appendf(&buf, &len, &cap, "mshell_spawn_latency_seconds_bucket{le=\"+Inf\"} %ld\n", counters.spawned);
+			appendf(&buf, &len, &cap, "mshell_spawn_latency_seconds_sum %.6lf\nmshell_spawn_latency_seconds_count %ld\n", counters.spawnsum, counters.spawned);
+			if(metrics) appendf(&buf, &len, &cap, "# TYPE mshell_command_wall_seconds histogram\n");
+			for(m = metrics; m; m = m->next) {
+				for(cum = i = 0; i < WALL_BUCKETS; i++) {
+					cum += m->buckets[i];
+					appendf(&buf, &len, &cap, "mshell_command_wall_seconds_bucket{command=");
+					appendLabel(&buf, &len, &cap, m->name);
+					appendf(&buf, &len, &cap, ",le=\"%g\"} %ld\n", wallBounds[i], cum);
+				}
+				appendf(&buf, &len, &cap, "mshell_command_wall_seconds_bucket{command=");
+				appendLabel(&buf, &len, &cap, m->name);
+				appendf(&buf, &len, &cap, ",le=\"+Inf\"} %ld\nmshell_command_wall_seconds_sum{command=", m->count);
+				appendLabel(&buf, &len, &cap, m->name);
+				appendf(&buf, &len, &cap, "} %.6lf\nmshell_command_wall_seconds_count{command=", m->wall);
+				appendLabel(&buf, &len, &cap, m->name);
+				appendf(&buf, &len, &cap, "} %ld\n", m->count);
+			}
+			if(metrics) appendf(&buf, &len, &cap, "# TYPE mshell_command_user_seconds_total counter\n");
+			for(m = metrics; m; m = m->next) {
+				appendf(&buf, &len, &cap, "mshell_command_user_seconds_total{command=");
+				appendLabel(&buf, &len, &cap, m->name);
+				appendf(&buf, &len, &cap, "} %.6lf\n", m->user);
+			}
+			if(metrics) appendf(&buf, &len, &cap, "# TYPE mshell_command_sys_seconds_total counter\n");
+			for(m = metrics; m; m = m->next) {
+				appendf(&buf, &len, &cap, "mshell_command_sys_seconds_total{command=");
+				appendLabel(&buf, &len, &cap, m->name);
+				appendf(&buf, &len, &cap, "} %.6lf\n", m->sys);
+			}
+		}
+		// a client that cannot take the snapshot at once gets a short read
+		send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(fd);
+	}
+}
+
+int exitStatus(int status) {
+	if(WIFEXITED(status)) return WEXITSTATUS(status);
+	if(WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+	return 1;
+}
+
+/**
+ * a script is any regular file that is either not executable or
+ * carries the .msh suffix (so '#!/path/to/mshell' scripts work too)
+ **/
+int isScript(char *path) {
+	struct stat sb;
+	int len = strlen(path);
+	if(stat(path, &sb) == -1 || !S_ISREG(sb.st_mode)) return 0;
+	if(len > 4 && !strcmp(path + len - 4, ".msh")) return 1;
+	return access(path, X_OK) == -1;
+}
+
+void openInput(Input *in, int fd, char *str) {
+	memset(in, 0, sizeof(Input));
+	in->fd = fd;
+	if(fd < 0) {
+		in->buf = str;
+		in->len = strlen(str);
+		in->eof = 1;
+	}
+	else in->buf = new char[INPUT_BLOCK];
+	in->lcap = 256;
+	in->line = new char[in->lcap];
+}
+
+void closeInput(Input *in) {
+	if(in->fd >= 0) delete [] in->buf;
+	delete [] in->line;
+	in->buf = in->line = NULL;
+}
+
+/**
+ * returns the next line without its trailing newline, or NULL on EOF.
+ * input is pulled in INPUT_BLOCK sized chunks and lines grow as needed,
+ * so there is no limit on the length of a single line.
+ **/
+char * readLine(Input *in) {
+	long n = 0, r;
+	char *nl = NULL, *tmp;
+
+	while(1) {
+		if(in->pos >= in->len) {
+			if(in->eof) break;
+			waitEvents(in->fd, 1);
+			do r = read(in->fd, in->buf, INPUT_BLOCK); while(r == -1 && errno == EINTR);
+			if(r <= 0) { in->eof = 1; break; }
+			in->len = r; in->pos = 0;
+		}
+		nl = (char *) memchr(in->buf + in->pos, '\n', in->len - in->pos);
+		r = (nl ? nl - in->buf : in->len) - in->pos;
+		if(n + r + 1 > in->lcap) {
+			while(n + r + 1 > in->lcap) in->lcap <<= 1;
+			tmp = new char[in->lcap];
+			memcpy(tmp, in->line, n);
+			delete [] in->line;
+			in->line = tmp;
+		}
+		memcpy(in->line + n, in->buf + in->pos, r);
+		n += r; in->pos += r;
+		if(nl) { in->pos++; break; }
+	}
+	if(!nl && !n) return NULL;
+	in->line[n] = 0;
+	return in->line;
+}
+
 void add(Node N) {
 	if(!head) {
 		head = new Node;
@@ -193,11 +1766,15 @@ void del(int pid) {
 		return;
 	}
 	curr = head;
-	while(curr->next && curr->next->pid == pid) {
-		temp = curr->next;
-		curr->next = temp->next;
-		delete temp;
-		return;
+	while(curr->next) {
+		if(curr->next->pid == pid) {
+			temp = curr->next;
+			curr->next = temp->next;
+			if(temp == tail) tail = curr;
+			delete temp;
+			return;
+		}
+		curr = curr->next;
 	}
 }
 
@@ -210,68 +1787,73 @@ Node * find(int pid) {
 	return NULL;
 }
 
-void changeDirectory(char *ptr) {
-	char curr[128];
-	int ret, i, pos;
-	
-	getcwd(curr, 128);
-	if(!ptr[0]) ret = chdir((const char *)getenv("HOME"));
-	else if(ptr[0]=='.' && ptr[1]!='.') {
-		strcat(curr, ptr+1);
-		ret = chdir((const char *)curr);
-	}
-	else if(!strcmp(ptr, "..")) {
-		for(i = pos = 0; curr[i]; i++) if(curr[i]=='/') pos = i;
-		if(!pos) pos++; curr[pos] = 0;
-		ret = chdir((const char *)curr);
-	}
-	else if(ptr[0]=='/') ret = chdir((const char *)ptr);
-	else {
-		strcat(curr, "/");
-		strcat(curr, ptr);
-		ret = chdir((const char *)curr);
+/**
+ * words are unbounded since the lexer rewrite, so relative paths are
+ * left for the kernel to resolve against the cwd instead of being
+ * glued onto it in a fixed buffer
+ **/
+int changeDirectory(char *ptr) {
+	char *home;
+	int ret;
+
+	if(!ptr[0]) ret = chdir((home = getenv("HOME")) ? home : "/");
+	else ret = chdir(ptr);
+	if(ret == -1) {
+		printf("mShell: %s: %s...\n", ptr, strerror(errno));
+		return 1;
 	}
-	if(ret == -1) printf("mShell: %s: No such directory...\n", ptr);
+	return 0;
 }
 
 void printWorkingDirectory(void) {
-	char curr[128];
-	puts(getcwd(curr, 128));
+	char curr[PATH_MAX];
+	if(getcwd(curr, sizeof(curr))) puts(curr);
+	else printf("mShell: pwd: %s...\n", strerror(errno));
 }
 
+// s must hold NAME_MAX + 1 bytes
 void getCurrentDirectory(char *s) {
-	char curr[128];
+	char curr[PATH_MAX];
 	int i, pos;
-	getcwd(curr, 128);
+	if(!getcwd(curr, sizeof(curr))) { strcpy(s, "?"); return; }
 	for(i = pos = 0; curr[i]; i++) if(curr[i] =='/') pos = i;
 	if(i == 1) strcpy(s, "/");
 	else strcpy(s, &curr[pos+1]);
 }
 
+/**
+ * reaps only the background jobs we know about, so that a foreground
+ * waitpid() never loses its child (and exit status) to this handler
+ **/
 void signalHandler(int sig) {
-	int status;
-	pid_t t_pid;
+	int status, err = errno;
 	rusage rs;
 	timeval ts;
 	Node *n;
 	if(sig == SIGCHLD) {
-		t_pid = wait(&status);
-		if(t_pid > 0) {
-			getrusage(RUSAGE_CHILDREN, &rs);
+		for(n = head; n; n = n->next) {
+			if(!n->done || wait4(n->pid, &status, WNOHANG, &rs) <= 0) continue;
 			gettimeofday(&ts, NULL);
-			n = find(t_pid);
-			if(n != NULL) {
-				n->ru = rs;
-				n->en = ts;
-				n->done = 0;
-			}
+			n->ru = rs;
+			n->en = ts;
+			n->status = exitStatus(status);
+			n->done = 0;
 		}
+		// wake whoever is waiting for input or for a foreground job
+		if(__NOTIFY_PIPE__[1] != -1) write(__NOTIFY_PIPE__[1], "", 1);
 	}
 	signal(SIGCHLD, signalHandler);
+	errno = err;
 }
 
-void showCompletedJobs(int incR) {
+int showCompletedJobs(int incR) {
 	Node *curr = head, *temp;
+	int cnt = 0;
+	sigset_t mask, omask;
+	// the SIGCHLD handler walks the same list
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &omask);
 	while(curr) {
 		temp = curr->next;
 		if(! curr->done) {
@@ -279,26 +1861,35 @@ void showCompletedJobs(int incR) {
 			if(__SHOW_DETAILS__) {
 				printMessage(&(curr->st), &(curr->en), &(curr->ru));
 			}
+			printPerf(curr->perf);
+			fflush(stdout);
+			runHook(curr);
+			recordCommand(curr->name, (curr->en.tv_sec - curr->st.tv_sec) + (curr->en.tv_usec - curr->st.tv_usec) / 1000000.0, &curr->ru, curr->execd);
+			removeCgroup(curr->cgpath);
 			del(curr->pid);
+			cnt++;
 		}
 		curr = temp;
 	}
+	sigprocmask(SIG_SETMASK, &omask, NULL);
 	if(incR) showRunningJobs();
+	return cnt;
 }
 
 void showRunningJobs() {
 	Node *curr = head;
 	while(curr) {
 		printf("[%d] %d\t[%s] Running.\n", curr->sl, curr->pid, curr->name);
+		showPlacement(curr);
 		curr = curr->next;
 	}
 }
 
 void printMessage(timeval *st, timeval *en, rusage *rs) {
 	timeval tu, tv;
-	int ist, ien;
-	ist = st->tv_sec * 10000000 + st->tv_usec;
-	ien = en->tv_sec * 10000000 + en->tv_usec;
+	double ist, ien;
+	ist = st->tv_sec * 1000000.0 + st->tv_usec;
+	ien = en->tv_sec * 1000000.0 + en->tv_usec;
 	tu = rs->ru_utime;
 	tv = rs->ru_stime;
 	printf("\n---Process Statistics---\n");
@@ -308,4 +1899,68 @@ void printMessage(timeval *st, timeval *en, rusage *rs) {
 	printf("------------------------\n");
 }
 
+/**
+ * opens one counter per perfEvents entry on pid (0 = the shell itself),
+ * created disabled; with onexec they start at the next execve(), and
+ * inherit makes them include the job's children. hardware events that
+ * perf_event_paranoid refuses are retried user-space only. unavailable
+ * events get fd -1; returns how many were opened
+ **/
+int perfOpen(pid_t pid, int *fds, int onexec) {
+	perf_event_attr pe;
+	int i, n = 0;
+	for(i = 0; i < PERF_EVENTS; i++) {
+		memset(&pe, 0, sizeof(perf_event_attr));
+		pe.size = sizeof(perf_event_attr);
+		pe.type = perfEvents[i].type;
+		pe.config = perfEvents[i].config;
+		pe.disabled = 1;
+		pe.inherit = 1;
+		pe.enable_on_exec = onexec;
+		pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		fds[i] = syscall(SYS_perf_event_open, &pe, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if(fds[i] == -1 && (errno == EACCES || errno == EPERM)) {
+			pe.exclude_kernel = pe.exclude_hv = 1;
+			fds[i] = syscall(SYS_perf_event_open, &pe, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		}
+		if(fds[i] != -1) n++;
+	}
+	return n;
+}
+
+void perfClose(int *fds) {
+	int i;
+	for(i = 0; i < PERF_EVENTS; i++) {
+		if(fds[i] != -1) close(fds[i]);
+		fds[i] = -1;
+	}
+}
+
+/**
+ * prints and closes the counters of a finished job; values are scaled
+ * up when the kernel had to multiplex them with other events
+ **/
+void printPerf(int *fds) {
+	unsigned long long v[3];
+	double val[PERF_EVENTS];
+	char str[PERF_EVENTS][32];
+	int i, n = 0;
+	for(i = 0; i < PERF_EVENTS; i++) {
+		val[i] = -1;
+		if(fds[i] == -1) { strcpy(str[i], "<not supported>"); continue; }
+		n++;
+		if(read(fds[i], v, sizeof(v)) != sizeof(v) || !v[2]) { strcpy(str[i], "<not counted>"); continue; }
+		val[i] = (v[2] < v[1] ? (double)v[0] * v[1] / v[2] : (double)v[0]);
+		if(i == PERF_EVENTS - 1) sprintf(str[i], "%.3lf(ms)", val[i] / 1000000.0);
+		else sprintf(str[i], "%.0lf%s", val[i], (v[2] < v[1] ? " (scaled)" : ""));
+	}
+	perfClose(fds);
+	if(!n) return;
+	printf("\n---Performance Counters---\n");
+	printf("cycles = %s; instructions = %s", str[0], str[1]);
+	if(val[0] > 0 && val[1] >= 0) printf("; insn per cycle = %.2lf", val[1] / val[0]);
+	printf("\ncache misses = %s; page faults = %s; task clock = %s\n", str[2], str[3], str[4]);
+	printf("--------------------------\n");
+}
+
 /* END OF SOURCE CODE */